@@ -0,0 +1,297 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+	\file       tgteralloc.h
+	\brief      Contains a pluggable allocator for the buffers owned by the library, a
+	            huge page allocator with parallel first-touch, and a buffer class.
+*/
+
+//--------------------------------------------------------------------------------------//
+
+/*
+MIT License
+
+Copyright (c) 2020 Matt Fairclough
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//--------------------------------------------------------------------------------------//
+
+#pragma once
+
+//--------------------------------------------------------------------------------------//
+
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+#include "tgteriodetails.h"
+
+//--------------------------------------------------------------------------------------//
+
+class TgTerAllocator
+{
+public:
+	virtual ~TgTerAllocator()
+	{
+	}
+
+	// row_bytes is the size of one row of the grid that will be stored in the memory, or
+	// 0 if unknown. It lets an allocator initialise memory in the same bands of rows that
+	// the library's parallel functions divide their work into (see TgTer_PartitionRows).
+	// Allocate must return memory suitably aligned for float, or nullptr on failure.
+
+	virtual void* Allocate(size_t bytes, size_t row_bytes) = 0;
+	virtual void Deallocate(void* memory, size_t bytes) = 0;
+};
+
+//--------------------------------------------------------------------------------------//
+
+// Large allocations are made from huge pages where the platform allows, for better TLB
+// reach when many threads sample a big heightfield. On Linux explicit huge pages
+// (MAP_HUGETLB) are tried first if enabled, then transparent huge pages (MADV_HUGEPAGE).
+// On Windows large pages are used if the process holds SeLockMemoryPrivilege.
+//
+// The memory is then zeroed by num_threads threads, each touching its own band of rows,
+// so that on NUMA machines each band's pages land on the node of the thread that touched
+// it. The threads are not pinned unless a placement is given: each calls
+// placement->Bind(part, num_parts) first. ReadTgTerFileParallel and
+// ComputeTgTerAltStatsParallel with the same number of threads and the same placement
+// work on the same bands from the same nodes, so each band stays node-local. Without a
+// placement the OS decides where threads run and locality isn't guaranteed. Small
+// allocations are made with operator new and are not touched.
+
+#define TGTER_HUGE_PAGE_BYTES (2 * 1024 * 1024)
+
+class TgTerHugePageAllocator : public TgTerAllocator
+{
+public:
+	TgTerHugePageAllocator(unsigned int num_threads, bool explicit_huge_pages,
+	                       const TgTerThreadPlacement* placement = nullptr)
+	  : numThreads(num_threads > 0 ? num_threads : 1),
+		explicitHugePages(explicit_huge_pages),
+		threadPlacement(placement ? *placement : TgTerThreadPlacement(nullptr, nullptr))
+	{
+	}
+
+	virtual void* Allocate(size_t bytes, size_t row_bytes)
+	{
+		if (bytes < TGTER_HUGE_PAGE_BYTES)
+		{
+			return ::operator new(bytes, std::nothrow);
+		}
+
+		const size_t rounded = RoundUp(bytes);
+		void* memory = nullptr;
+
+#if defined(__linux__)
+		if (explicitHugePages)
+		{
+			memory = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		}
+		if (!memory || memory == MAP_FAILED)
+		{
+			memory = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (memory == MAP_FAILED)
+			{
+				return nullptr;
+			}
+#ifdef MADV_HUGEPAGE
+			madvise(memory, rounded, MADV_HUGEPAGE);
+#endif
+		}
+#elif defined(_WIN32)
+		const SIZE_T large_page = GetLargePageMinimum();
+		if (explicitHugePages && large_page > 0 && rounded % large_page == 0)
+		{
+			memory = VirtualAlloc(nullptr, rounded,
+				MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		}
+		if (!memory)
+		{
+			memory = VirtualAlloc(nullptr, rounded, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		}
+#else
+		memory = ::operator new(rounded, std::nothrow);
+#endif
+
+		if (memory)
+		{
+			FirstTouch((unsigned char*)memory, bytes, row_bytes);
+		}
+		return memory;
+	}
+
+	virtual void Deallocate(void* memory, size_t bytes)
+	{
+		if (!memory)
+		{
+			return;
+		}
+
+		if (bytes < TGTER_HUGE_PAGE_BYTES)
+		{
+			::operator delete(memory);
+			return;
+		}
+
+#if defined(__linux__)
+		munmap(memory, RoundUp(bytes));
+#elif defined(_WIN32)
+		VirtualFree(memory, 0, MEM_RELEASE);
+#else
+		::operator delete(memory);
+#endif
+	}
+
+private:
+	static size_t RoundUp(size_t bytes)
+	{
+		return (bytes + TGTER_HUGE_PAGE_BYTES - 1) / TGTER_HUGE_PAGE_BYTES * TGTER_HUGE_PAGE_BYTES;
+	}
+
+	void FirstTouch(unsigned char* memory, size_t bytes, size_t row_bytes)
+	{
+		//without a row size, treat each byte as a row so the bands are still contiguous
+		const size_t unit = row_bytes > 0 ? row_bytes : 1;
+		const uint64_t num_units = (bytes + unit - 1) / unit;
+		const unsigned int num_parts = (unsigned int)TGTER_MIN((uint64_t)numThreads, num_units);
+
+		//TgTer_PartitionRows works in 32-bit rows, which covers any TER grid; for anything
+		//bigger fall back to touching it all from this thread
+		if (num_parts <= 1 || num_units > 0xFFFFFFFFu)
+		{
+			memset(memory, 0, bytes);
+			return;
+		}
+
+		std::vector<std::thread> threads;
+		for (unsigned int t = 0; t < num_parts; ++t)
+		{
+			uint32_t first, count;
+			TgTer_PartitionRows((uint32_t)num_units, num_parts, t, &first, &count);
+
+			const size_t begin = (size_t)first * unit;
+			const size_t end = TGTER_MIN((size_t)(first + count) * unit, bytes);
+			const TgTerThreadPlacement placement = threadPlacement;
+			threads.push_back(std::thread([memory, begin, end, t, num_parts, placement]
+			{
+				placement.Bind(t, num_parts);
+				memset(memory + begin, 0, end - begin);
+			}));
+		}
+		for (size_t t = 0; t < threads.size(); ++t)
+		{
+			threads[t].join();
+		}
+	}
+
+	const unsigned int numThreads;
+	const bool explicitHugePages;
+	const TgTerThreadPlacement threadPlacement;
+};
+
+//--------------------------------------------------------------------------------------//
+
+inline TgTerAllocator* TgTer_DefaultAllocator()
+{
+	//transparent huge pages, first-touched by one thread per hardware thread
+	static TgTerHugePageAllocator allocator(std::thread::hardware_concurrency(), false);
+	return &allocator;
+}
+
+//--------------------------------------------------------------------------------------//
+
+// An array of floats owned by the library, e.g. the alts of a TgTerPrefetchedTerrain.
+// Memory comes from the allocator given at construction (TgTer_DefaultAllocator() if
+// nullptr) and is kept when the buffer is resized smaller, so that recycled buffers don't
+// reallocate. Resizing larger discards the contents.
+
+class TgTerBuffer
+{
+public:
+	explicit TgTerBuffer(TgTerAllocator* buffer_allocator = nullptr)
+	  : allocator(buffer_allocator ? buffer_allocator : TgTer_DefaultAllocator()),
+		data(nullptr),
+		size(0),
+		capacity(0)
+	{
+	}
+
+	~TgTerBuffer()
+	{
+		allocator->Deallocate(data, capacity * sizeof(float));
+	}
+
+	bool Resize(size_t num_floats, size_t row_floats)
+	{
+		//row_floats is passed on to the allocator as the row size, 0 if unknown
+
+		if (num_floats > capacity)
+		{
+			allocator->Deallocate(data, capacity * sizeof(float));
+			data = (float*)allocator->Allocate(num_floats * sizeof(float), row_floats * sizeof(float));
+			capacity = data ? num_floats : 0;
+		}
+		size = data ? num_floats : 0;
+		return data != nullptr || num_floats == 0;
+	}
+
+	float* Data()
+	{
+		return data;
+	}
+
+	const float* Data() const
+	{
+		return data;
+	}
+
+	size_t Size() const
+	{
+		return size;
+	}
+
+private:
+	TgTerBuffer(const TgTerBuffer&);
+	TgTerBuffer& operator=(const TgTerBuffer&);
+
+	TgTerAllocator* allocator;
+	float* data;
+	size_t size;
+	size_t capacity;
+};
+
+//--------------------------------------------------------------------------------------//
+
+//////////////////////////////////////////////////////////////////////////////////////////
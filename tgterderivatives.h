@@ -0,0 +1,236 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+	\file       tgterderivatives.h
+	\brief      Contains functions for computing surface normals, slope and aspect while
+	            a Terragen TER file is being decoded. Used by tgterread.h.
+*/
+
+//--------------------------------------------------------------------------------------//
+
+/*
+MIT License
+
+Copyright (c) 2020 Matt Fairclough
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//--------------------------------------------------------------------------------------//
+
+#pragma once
+
+//--------------------------------------------------------------------------------------//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+
+#include "tgtertypes.h"
+#include "tgteriodetails.h"
+
+//--------------------------------------------------------------------------------------//
+
+inline void TgTer_CentralDifferencesRow(
+	const float* above, const float* row, const float* below, uint32_t width,
+	float x_multiplier, float y_multiplier, float* gx, float* gy)
+{
+	//gx[x] = (row[x+1] - row[x-1]) * x_multiplier
+	//gy[x] = (below[x] - above[x]) * y_multiplier
+	//with one-sided differences (twice the multiplier) at the ends of the row
+
+	if (width < 2)
+	{
+		if (width == 1)
+		{
+			gx[0] = 0.0f;
+			gy[0] = (below[0] - above[0]) * y_multiplier;
+		}
+		return;
+	}
+
+	uint32_t x = 1;
+	const uint32_t end = width - 1;
+
+#ifdef TGTER_SSE2
+	const __m128 xm = _mm_set1_ps(x_multiplier);
+	const __m128 ym = _mm_set1_ps(y_multiplier);
+	for (; x + 4 <= end; x += 4)
+	{
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(row + x + 1), _mm_loadu_ps(row + x - 1));
+		__m128 dy = _mm_sub_ps(_mm_loadu_ps(below + x), _mm_loadu_ps(above + x));
+		_mm_storeu_ps(gx + x, _mm_mul_ps(dx, xm));
+		_mm_storeu_ps(gy + x, _mm_mul_ps(dy, ym));
+	}
+#endif
+
+	for (; x < end; ++x)
+	{
+		gx[x] = (row[x + 1] - row[x - 1]) * x_multiplier;
+		gy[x] = (below[x] - above[x]) * y_multiplier;
+	}
+
+	gx[0] = (row[1] - row[0]) * (2.0f * x_multiplier);
+	gy[0] = (below[0] - above[0]) * y_multiplier;
+	gx[end] = (row[end] - row[end - 1]) * (2.0f * x_multiplier);
+	gy[end] = (below[end] - above[end]) * y_multiplier;
+}
+
+inline void TgTer_EncodeNormalsRow(
+	const float* gx, const float* gy, uint32_t width, int encoding, int16_t* normals)
+{
+	//the unnormalised normal is (-gx, -gy, 1)
+	//
+	//octahedral: (nx, ny) / (|nx| + |ny| + nz), which is the same before or after
+	//            normalisation, and nz > 0 so the lower hemisphere fold is never needed
+	//xy:         (nx, ny) / sqrt(nx*nx + ny*ny + nz*nz)
+
+	uint32_t x = 0;
+
+#ifdef TGTER_SSE2
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 snorm = _mm_set1_ps(32767.0f);
+	const __m128 signmask = _mm_set1_ps(-0.0f);
+	for (; x + 4 <= width; x += 4)
+	{
+		__m128 nx = _mm_xor_ps(_mm_loadu_ps(gx + x), signmask);
+		__m128 ny = _mm_xor_ps(_mm_loadu_ps(gy + x), signmask);
+		__m128 denom;
+		if (encoding == 0)
+		{
+			denom = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signmask, nx), _mm_andnot_ps(signmask, ny)), one);
+		}
+		else
+		{
+			denom = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), one));
+		}
+		__m128 s = _mm_div_ps(snorm, denom);
+		__m128i ix = _mm_cvtps_epi32(_mm_mul_ps(nx, s));
+		__m128i iy = _mm_cvtps_epi32(_mm_mul_ps(ny, s));
+		__m128i xs = _mm_packs_epi32(ix, ix);
+		__m128i ys = _mm_packs_epi32(iy, iy);
+		_mm_storeu_si128((__m128i*)(normals + 2 * x), _mm_unpacklo_epi16(xs, ys));
+	}
+#endif
+
+	for (; x < width; ++x)
+	{
+		const float nx = -gx[x];
+		const float ny = -gy[x];
+		const float denom = (encoding == 0)
+			? fabsf(nx) + fabsf(ny) + 1.0f
+			: sqrtf(nx * nx + ny * ny + 1.0f);
+		const float s = 32767.0f / denom;
+		normals[2 * x + 0] = (int16_t)lrintf(nx * s);
+		normals[2 * x + 1] = (int16_t)lrintf(ny * s);
+	}
+}
+
+inline void TgTer_SlopeAspectRow(
+	const float* gx, const float* gy, uint32_t width, float* slopes, float* aspects)
+{
+	for (uint32_t x = 0; x < width; ++x)
+	{
+		if (slopes) slopes[x] = atanf(sqrtf(gx[x] * gx[x] + gy[x] * gy[x]));
+		if (aspects) aspects[x] = atan2f(-gy[x], -gx[x]);
+	}
+}
+
+//--------------------------------------------------------------------------------------//
+
+inline bool TgTer_ReadAltwSamplesWithDerivatives(
+	FILE* inf, uint32_t width, uint32_t height, const float* scale_m,
+	int16_t heightscale, int16_t baseheight,
+	TgTerAlts* destination, TgTerDerivatives* derivatives,
+	TgTerAltwAccumulator* optional_accumulator)
+{
+	//Decodes the heightfield row by row into a rolling window of three rows, copying
+	//each row to destination and computing the derivatives of the row before it, so the
+	//heights are never read back from destination and the working set stays in cache.
+
+	if (width == 0 || height == 0)
+	{
+		return true;
+	}
+
+	//window rows are in file units, as they would be with a readMultiplier of 1
+	std::vector<float> window((size_t)width * 5);
+	float* rows[3] = { &window[0], &window[width], &window[2 * (size_t)width] };
+	float* gx = &window[3 * (size_t)width];
+	float* gy = &window[4 * (size_t)width];
+
+	const float xmult = 0.5f * scale_m[2] / scale_m[0];
+	const float ymult = 0.5f * scale_m[2] / scale_m[1];
+	const float destmult = destination->readMultiplier;
+	const uint64_t dstride = destination->stride;
+
+	for (uint32_t y = 0; y <= height; ++y)
+	{
+		if (y < height)
+		{
+			float* row = rows[y % 3];
+			if (!TgTer_ReadAltwSamples(inf, width, heightscale, baseheight, 1.0f, row, 1,
+				optional_accumulator))
+			{
+				return false;
+			}
+
+			float* d = destination->alts + (uint64_t)y * width * dstride;
+			for (uint32_t x = 0; x < width; ++x)
+			{
+				d[x * dstride] = row[x] * destmult;
+			}
+		}
+
+		if (y == 0)
+		{
+			continue;
+		}
+
+		//derivatives of row y-1, clamping the window at the top and bottom edges
+		const uint32_t r = y - 1;
+		const float* above = rows[(r > 0 ? r - 1 : r) % 3];
+		const float* below = rows[(r + 1 < height ? r + 1 : r) % 3];
+		const float* row = rows[r % 3];
+		const bool edge = (r == 0 || r + 1 == height);
+
+		TgTer_CentralDifferencesRow(above, row, below, width,
+			xmult, edge ? 2.0f * ymult : ymult, gx, gy);
+
+		const uint64_t first = (uint64_t)r * width;
+		if (derivatives->normals)
+		{
+			TgTer_EncodeNormalsRow(gx, gy, width, derivatives->normalEncoding,
+				derivatives->normals + 2 * first);
+		}
+		if (derivatives->slopes || derivatives->aspects)
+		{
+			TgTer_SlopeAspectRow(gx, gy, width,
+				derivatives->slopes ? derivatives->slopes + first : nullptr,
+				derivatives->aspects ? derivatives->aspects + first : nullptr);
+		}
+	}
+
+	return true;
+}
+
+//--------------------------------------------------------------------------------------//
+
+//////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,534 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+	\file       tgteredit.h
+	\brief      Contains functions for editing existing Terragen TER files in place,
+	            without decoding and rewriting all of their altitudes.
+*/
+
+//--------------------------------------------------------------------------------------//
+
+/*
+MIT License
+
+Copyright (c) 2020 Matt Fairclough
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//--------------------------------------------------------------------------------------//
+
+#pragma once
+
+//--------------------------------------------------------------------------------------//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#include "tgtertypes.h"
+#include "tgteriodetails.h"
+#include "tgterwrite.h"
+
+//--------------------------------------------------------------------------------------//
+
+typedef ResultOf_WriteTgTerFile ResultOf_RewriteTgTerFileMetadata;
+typedef ResultOf_WriteTgTerFile ResultOf_PatchTgTerFile;
+
+//--------------------------------------------------------------------------------------//
+
+inline bool TgTer_SameFile(const char* filename_a, const char* filename_b)
+{
+	//true if both names refer to the same existing file, however they are spelled
+
+#if defined(_WIN32)
+	char full_a[_MAX_PATH];
+	char full_b[_MAX_PATH];
+	return _fullpath(full_a, filename_a, _MAX_PATH) && _fullpath(full_b, filename_b, _MAX_PATH) &&
+		_stricmp(full_a, full_b) == 0;
+#else
+	struct stat stat_a;
+	struct stat stat_b;
+	return stat(filename_a, &stat_a) == 0 && stat(filename_b, &stat_b) == 0 &&
+		stat_a.st_dev == stat_b.st_dev && stat_a.st_ino == stat_b.st_ino;
+#endif
+}
+
+inline FILE* TgTer_CreateTempFile(const char* filename, std::string* temp_filename)
+{
+	//creates a new, uniquely named file next to filename for writing, never reusing or
+	//truncating an existing file. returns nullptr if none could be created.
+
+	for (unsigned int attempt = 0; attempt < 1000; ++attempt)
+	{
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%u.tmp", attempt);
+		*temp_filename = std::string(filename) + suffix;
+
+#if defined(_WIN32)
+		const int fd = _open(temp_filename->c_str(),
+			_O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY, _S_IREAD | _S_IWRITE);
+		FILE* fp = (fd >= 0) ? _fdopen(fd, "wb") : nullptr;
+#else
+		const int fd = open(temp_filename->c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
+		FILE* fp = (fd >= 0) ? fdopen(fd, "wb") : nullptr;
+#endif
+		if (fp)
+		{
+			return fp;
+		}
+		if (fd >= 0)
+		{
+#if defined(_WIN32)
+			_close(fd);
+#else
+			close(fd);
+#endif
+			remove(temp_filename->c_str());
+			return nullptr;
+		}
+		if (errno != EEXIST)
+		{
+			return nullptr;
+		}
+	}
+	return nullptr;
+}
+
+inline bool TgTer_ReplaceFile(const char* temp_filename, const char* filename)
+{
+	//replaces filename with temp_filename in one step, so that filename is never missing
+
+#if defined(_WIN32)
+	return MoveFileExA(temp_filename, filename,
+		MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return rename(temp_filename, filename) == 0;
+#endif
+}
+
+inline bool TgTer_CopyRange(FILE* inf, int64_t offset, uint64_t bytes, FILE* outf)
+{
+	//copies bytes from offset in inf, byte for byte, returns false if they aren't all there
+
+	if (TgTer_Seek64(inf, offset) != 0)
+	{
+		return false;
+	}
+
+	std::vector<unsigned char> buf((size_t)TGTER_MIN(bytes, (uint64_t)(1024 * 1024)));
+	while (bytes > 0)
+	{
+		const size_t n = (size_t)TGTER_MIN(bytes, (uint64_t)buf.size());
+		if (fread(buf.data(), 1, n, inf) != n || fwrite(buf.data(), 1, n, outf) != n)
+		{
+			return false;
+		}
+		bytes -= n;
+	}
+	return true;
+}
+
+inline bool TgTer_CopyToEnd(FILE* inf, int64_t offset, FILE* outf, uint64_t min_bytes)
+{
+	//copies everything from offset to the end of inf, byte for byte,
+	//returns false if fewer than min_bytes were there to copy
+
+	if (TgTer_Seek64(inf, offset) != 0)
+	{
+		return false;
+	}
+
+	std::vector<unsigned char> buf(1024 * 1024);
+	uint64_t copied = 0;
+	size_t n;
+	while ((n = fread(buf.data(), 1, buf.size(), inf)) > 0)
+	{
+		if (fwrite(buf.data(), 1, n, outf) != n)
+		{
+			return false;
+		}
+		copied += n;
+	}
+	return !ferror(inf) && copied >= min_bytes;
+}
+
+//--------------------------------------------------------------------------------------//
+
+inline ResultOf_RewriteTgTerFileMetadata
+	RewriteTgTerFileMetadata(
+		const char* filename,
+		const TgTerHeader* header,
+		const char* output_filename)
+{
+	/*
+	Replaces the scale and planetary context (scaleM, planetCurveRadiusKm and
+	planetCurveMode) of an existing file with those in header. The altitudes are not
+	decoded or re-quantized, so they come through bit for bit. pointsX and pointsY in
+	header are ignored, because the dimensions can't change without new altitudes.
+
+	If output_filename is nullptr the file is edited in place. When it already has SCAL,
+	CRAD and CRVM chunks they are overwritten where they are, which only writes a few
+	bytes. Otherwise, or if output_filename is given, new header chunks are written to
+	the output file and everything from the ALTW chunk onwards is copied byte for byte.
+	An in-place rewrite goes through a uniquely named temporary file next to the original,
+	which then replaces it in one step. An
+	output_filename that names the input file is treated as an in-place edit.
+	*/
+
+	if (output_filename && TgTer_SameFile(filename, output_filename))
+	{
+		output_filename = nullptr;
+	}
+
+	FILE* fp = fopen(filename, output_filename ? "rb" : "r+b");
+
+	if (!fp)
+	{
+		return ResultOf_RewriteTgTerFileMetadata(false, filename, "Unable to open terrain file");
+	}
+
+	TgTerFileInfo info;
+
+	if (!TgTer_ReadFileInfo(fp, &info))
+	{
+		fclose(fp);
+		return ResultOf_RewriteTgTerFileMetadata(false, filename, "This is not a Terragen terrain file");
+	}
+
+	if (info.altwOffset < 0)
+	{
+		fclose(fp);
+		return ResultOf_RewriteTgTerFileMetadata(false, filename, "Terrain file has no altitude data");
+	}
+
+	if (!output_filename && info.scalOffset >= 0 && info.cradOffset >= 0 && info.crvmOffset >= 0)
+	{
+		//patch the chunks in place, they are the same size as before
+
+		bool ok = TgTer_Seek64(fp, info.scalOffset + 4) == 0;
+		TgTer_PutIntel_Float(fp, header->scaleM[0]);
+		TgTer_PutIntel_Float(fp, header->scaleM[1]);
+		TgTer_PutIntel_Float(fp, header->scaleM[2]);
+
+		ok = ok && TgTer_Seek64(fp, info.cradOffset + 4) == 0;
+		TgTer_PutIntel_Float(fp, header->planetCurveRadiusKm);
+
+		ok = ok && TgTer_Seek64(fp, info.crvmOffset + 4) == 0;
+		TgTer_PutIntel_UShort(fp, header->planetCurveMode);
+
+		ok = (fclose(fp) == 0) && ok;
+		if (!ok)
+		{
+			return ResultOf_RewriteTgTerFileMetadata(false, filename, "Unable to write terrain file");
+		}
+		return ResultOf_RewriteTgTerFileMetadata(true, filename, "");
+	}
+
+	//write new header chunks, then copy the ALTW chunk and the rest of the file
+
+	std::string outname;
+	FILE* of = nullptr;
+	if (output_filename)
+	{
+		outname = output_filename;
+		of = fopen(output_filename, "wb");
+	}
+	else
+	{
+		of = TgTer_CreateTempFile(filename, &outname);
+	}
+
+	if (!of)
+	{
+		fclose(fp);
+		return ResultOf_RewriteTgTerFileMetadata(false, outname, "Unable to open output file");
+	}
+
+	TgTerHeader newheader(*header);
+	newheader.pointsX = info.pointsX;
+	newheader.pointsY = info.pointsY;
+	TgTer_WriteHeaderChunks(of, &newheader);
+
+	//the ALTW marker, base and scale, and every sample must be there
+	const bool copied = TgTer_CopyToEnd(fp, info.altwOffset, of, 8 + 2 * info.NumPoints());
+	const bool written = (fclose(of) == 0);
+	fclose(fp);
+
+	if (!copied || !written)
+	{
+		remove(outname.c_str());
+		return ResultOf_RewriteTgTerFileMetadata(false, outname,
+			copied ? "Unable to write output file" : "Unable to copy altitude data, the terrain file may be truncated");
+	}
+
+	if (!output_filename)
+	{
+		if (!TgTer_ReplaceFile(outname.c_str(), filename))
+		{
+			//the original is untouched and the rewritten terrain is kept in outname
+			return ResultOf_RewriteTgTerFileMetadata(false, filename,
+				"Unable to replace terrain file, the rewritten terrain is in " + outname);
+		}
+		return ResultOf_RewriteTgTerFileMetadata(true, filename, "");
+	}
+
+	return ResultOf_RewriteTgTerFileMetadata(true, outname, "");
+}
+
+//--------------------------------------------------------------------------------------//
+
+inline bool TgTer_AltwCanEncode(float minalt, float maxalt, int16_t heightscale, int16_t baseheight)
+{
+	//true if alts (in file units) in this range encode without overflowing int16,
+	//using TgTer_WriteAltwSamples with round_to_nearest
+
+	if (heightscale == 0)
+	{
+		//a flat terrain at an integer height, e.g. a blank canvas from WriteTgTerFile,
+		//can only hold baseheight. allow for the rounding of a round trip through metres.
+		const float tolerance = 1e-5f * TGTER_MAX(1.0f, fabsf((float)baseheight));
+		return fabsf(minalt - baseheight) <= tolerance && fabsf(maxalt - baseheight) <= tolerance;
+	}
+	if (heightscale < 0)
+	{
+		return false;
+	}
+	const float scalar = 65536.0f / heightscale;
+	const float lo = (minalt - baseheight) * scalar;
+	const float hi = (maxalt - baseheight) * scalar;
+	return lo >= -32768.5f && hi < 32767.5f;
+}
+
+//--------------------------------------------------------------------------------------//
+
+inline ResultOf_PatchTgTerFile
+	PatchTgTerFile(
+		const char* filename,
+		const uint32_t x0,
+		const uint32_t y0,
+		const uint32_t width,
+		const uint32_t height,
+		const TgTerAlts* source,
+		bool* optional_requantized)
+{
+	/*
+	Writes a rectangle of width x height altitudes from source into an existing file,
+	with its corner at point (x0, y0). source holds width * height alts, row by row, and
+	its writeMultiplier converts them to file units as for WriteTgTerFile.
+
+	If the new alts can be represented with the file's current ALTW base and scale, only
+	the samples in the rectangle are written, one positioned write per row. They are
+	rounded to the nearest sample value, so alts that were read from this file and not
+	changed are written back exactly as they were.
+
+	Otherwise the base and scale are chosen again to cover the rest of the file and the
+	new alts, and every sample is re-quantized, a row at a time, into a uniquely named
+	temporary file next to the original, which then replaces it in one step. The original
+	is never left half re-quantized. optional_requantized reports which happened.
+	*/
+
+	if (optional_requantized)
+	{
+		*optional_requantized = false;
+	}
+
+	FILE* fp = fopen(filename, "r+b");
+
+	if (!fp)
+	{
+		return ResultOf_PatchTgTerFile(false, filename, "Unable to open terrain file");
+	}
+
+	TgTerFileInfo info;
+
+	if (!TgTer_ReadFileInfo(fp, &info))
+	{
+		fclose(fp);
+		return ResultOf_PatchTgTerFile(false, filename, "This is not a Terragen terrain file");
+	}
+
+	if (info.altwDataOffset < 0)
+	{
+		fclose(fp);
+		return ResultOf_PatchTgTerFile(false, filename, "Terrain file has no altitude data");
+	}
+
+	if ((uint64_t)x0 + width > info.pointsX || (uint64_t)y0 + height > info.pointsY)
+	{
+		fclose(fp);
+		return ResultOf_PatchTgTerFile(false, filename, "Patch is outside the terrain");
+	}
+
+	if (width == 0 || height == 0)
+	{
+		fclose(fp);
+		return ResultOf_PatchTgTerFile(true, filename, "");
+	}
+
+	const uint64_t sstride = source->stride;
+	const float mult = source->writeMultiplier;
+
+	TgTerAltRange patchRange(0.0f, 0.0f);
+	patchRange.Compute(source, (uint64_t)width * height);
+	const float a = patchRange.minAlt * mult;
+	const float b = patchRange.maxAlt * mult;
+	const float patchmin = TGTER_MIN(a, b);
+	const float patchmax = TGTER_MAX(a, b);
+
+	if (TgTer_AltwCanEncode(patchmin, patchmax, info.heightscale, info.baseheight))
+	{
+		//the new alts fit, so only touch the rectangle
+
+		bool ok = true;
+		for (uint32_t j = 0; j < height && ok; ++j)
+		{
+			const uint64_t first = (uint64_t)(y0 + j) * info.pointsX + x0;
+			ok = TgTer_Seek64(fp, info.altwDataOffset + (int64_t)(first * 2)) == 0 &&
+				TgTer_WriteAltwSamples(fp, width, info.heightscale, info.baseheight, mult,
+					source->alts + (uint64_t)j * width * sstride, source->stride, true);
+		}
+
+		ok = (fclose(fp) == 0) && ok;
+		if (!ok)
+		{
+			return ResultOf_PatchTgTerFile(false, filename, "Unable to write terrain file");
+		}
+		return ResultOf_PatchTgTerFile(true, filename, "");
+	}
+
+	//they don't fit, so find the range of everything outside the rectangle and choose a
+	//new base and scale for that plus the new alts. rows are decoded in file units.
+
+	std::vector<float> row(info.pointsX);
+
+	float minalt = patchmin;
+	float maxalt = patchmax;
+
+	bool ok = TgTer_Seek64(fp, info.altwDataOffset) == 0;
+	for (uint32_t y = 0; y < info.pointsY && ok; ++y)
+	{
+		ok = TgTer_ReadAltwSamples(fp, info.pointsX, info.heightscale, info.baseheight,
+			1.0f, row.data(), 1);
+
+		const bool inpatch = (y >= y0 && y < y0 + height);
+		for (uint32_t x = 0; x < info.pointsX && ok; ++x)
+		{
+			if (inpatch && x >= x0 && x < x0 + width)
+			{
+				continue;
+			}
+			if (row[x] < minalt) minalt = row[x];
+			if (row[x] > maxalt) maxalt = row[x];
+		}
+	}
+
+	if (!ok)
+	{
+		fclose(fp);
+		return ResultOf_PatchTgTerFile(false, filename, "Terrain file is truncated");
+	}
+
+	int16_t heightscale, baseheight;
+	TgTer_ChooseAltwScale(minalt, maxalt, &heightscale, &baseheight);
+
+	//write the re-quantized terrain to a temporary file: the chunks before ALTW as they
+	//were, the new ALTW base and scale, every row with the new alts overlaid, and then
+	//whatever followed the samples
+
+	std::string tempname;
+	FILE* of = TgTer_CreateTempFile(filename, &tempname);
+
+	if (!of)
+	{
+		fclose(fp);
+		return ResultOf_PatchTgTerFile(false, filename, "Unable to create temporary file");
+	}
+
+	ok = TgTer_CopyRange(fp, 0, (uint64_t)info.altwOffset, of);
+
+	fwrite("ALTW", 4, 1, of);
+	TgTer_PutIntel_UShort(of, heightscale);
+	TgTer_PutIntel_UShort(of, baseheight);
+
+	ok = ok && TgTer_Seek64(fp, info.altwDataOffset) == 0;
+	for (uint32_t y = 0; y < info.pointsY && ok; ++y)
+	{
+		ok = TgTer_ReadAltwSamples(fp, info.pointsX, info.heightscale, info.baseheight,
+			1.0f, row.data(), 1);
+
+		if (ok && y >= y0 && y < y0 + height)
+		{
+			const float* s = source->alts + (uint64_t)(y - y0) * width * sstride;
+			for (uint32_t i = 0; i < width; ++i)
+			{
+				row[x0 + i] = s[i * sstride] * mult;
+			}
+		}
+
+		ok = ok && TgTer_WriteAltwSamples(of, info.pointsX, heightscale, baseheight,
+			1.0f, row.data(), 1, true);
+	}
+
+	ok = ok && TgTer_CopyToEnd(fp, info.altwDataOffset + (int64_t)(2 * info.NumPoints()), of, 0);
+
+	ok = (fclose(of) == 0) && ok;
+	fclose(fp);
+
+	if (!ok)
+	{
+		remove(tempname.c_str());
+		return ResultOf_PatchTgTerFile(false, filename, "Unable to write terrain file");
+	}
+
+	if (!TgTer_ReplaceFile(tempname.c_str(), filename))
+	{
+		//the original is untouched and the patched terrain is kept in tempname
+		return ResultOf_PatchTgTerFile(false, filename,
+			"Unable to replace terrain file, the patched terrain is in " + tempname);
+	}
+
+	if (optional_requantized)
+	{
+		*optional_requantized = true;
+	}
+	return ResultOf_PatchTgTerFile(true, filename, "");
+}
+
+//--------------------------------------------------------------------------------------//
+
+//////////////////////////////////////////////////////////////////////////////////////////
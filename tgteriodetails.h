@@ -39,6 +39,20 @@ SOFTWARE.
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+//SSE2 versions of the hot loops are used where the compiler targets it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TGTER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+//--------------------------------------------------------------------------------------//
+
+#define TGTER_MAX(a, b) (a > b ? a : b)
+#define TGTER_MIN(a, b) (a < b ? a : b)
 
 //--------------------------------------------------------------------------------------//
 
@@ -65,6 +79,9 @@ void TgTer_PutMoto_Float(FILE* outf, float val);
 void TgTer_GetIntel_Float(FILE* inf, float* val);
 void TgTer_GetMoto_Float(FILE* inf, float* val);
 
+int TgTer_Seek64(FILE* fp, int64_t offset);
+int64_t TgTer_Tell64(FILE* fp);
+
 //--------------------------------------------------------------------------------------//
 
 inline void TgTer_PutIntel_Byte(FILE* outf, unsigned char val)
@@ -245,4 +262,428 @@ inline void TgTer_GetMoto_Float(FILE* inf, float* val)
 
 //--------------------------------------------------------------------------------------//
 
+// 64-bit file positioning. A maximum-size TER file (65535 x 65535 points) holds more
+// than 8 GB of ALTW samples, which is beyond the reach of fseek/ftell's long on some
+// platforms. On 32-bit POSIX builds define _FILE_OFFSET_BITS=64 before including this.
+
+inline int TgTer_Seek64(FILE* fp, int64_t offset)
+{
+#if defined(_WIN32)
+	return _fseeki64(fp, offset, SEEK_SET);
+#else
+	return fseeko(fp, (off_t)offset, SEEK_SET);
+#endif
+}
+
+inline int64_t TgTer_Tell64(FILE* fp)
+{
+#if defined(_WIN32)
+	return _ftelli64(fp);
+#else
+	return (int64_t)ftello(fp);
+#endif
+}
+
+//--------------------------------------------------------------------------------------//
+
+// Everything found in the chunks of a TER file up to and including the ALTW header,
+// along with where those chunks live in the file.
+
+class TgTerFileInfo
+{
+public:
+	uint16_t pointsX;
+	uint16_t pointsY;
+	float scaleM[3];
+	float planetCurveRadiusKm;
+	uint16_t planetCurveMode;
+	int16_t heightscale;
+	int16_t baseheight;
+
+	// Byte offsets of the chunk markers, or -1 if the chunk is not in the file.
+	int64_t scalOffset;
+	int64_t cradOffset;
+	int64_t crvmOffset;
+	int64_t altwOffset;
+
+	// Byte offset of the first ALTW sample, or -1 if there is no ALTW chunk.
+	int64_t altwDataOffset;
+
+	TgTerFileInfo()
+	  : pointsX(0),
+		pointsY(0),
+		planetCurveRadiusKm(6370.0f),
+		planetCurveMode(0),
+		heightscale(0),
+		baseheight(0),
+		scalOffset(-1),
+		cradOffset(-1),
+		crvmOffset(-1),
+		altwOffset(-1),
+		altwDataOffset(-1)
+	{
+		scaleM[0] = 30.0f;
+		scaleM[1] = 30.0f;
+		scaleM[2] = 30.0f;
+	}
+
+	uint64_t NumPoints() const
+	{
+		return (uint64_t)pointsX * (uint64_t)pointsY;
+	}
+};
+
+inline bool TgTer_ReadFileInfo(FILE* fp, TgTerFileInfo* info)
+{
+	// Reads from the start of the file up to the first ALTW sample (or the EOF chunk).
+	// If there is an ALTW chunk the file is left positioned at its first sample.
+	// Returns false if this is not a Terragen terrain file.
+
+	char buf[17 * sizeof(char)];
+	buf[16] = '\0';
+
+	if (fread(buf,16,sizeof(char),fp) != sizeof(char) || strncmp(buf,"TERRAGENTERRAIN ",16))
+	{
+		return false;
+	}
+
+	uint16_t pad;
+	uint16_t size;
+
+	*info = TgTerFileInfo();
+
+	bool done = false;
+	while (!done)
+	{
+		const int64_t offset = TgTer_Tell64(fp);
+
+		if (fread(buf, 4, sizeof(char), fp ) != sizeof(char))
+		{
+			break;
+		}
+		buf[4] = '\0';
+
+		if (!strcmp(buf,"SIZE"))
+		{
+			TgTer_GetIntel_UShort(fp,&size);
+			TgTer_GetIntel_UShort(fp,&pad);
+			if (info->pointsX == 0) info->pointsX = size + 1;
+			if (info->pointsY == 0) info->pointsY = size + 1;
+		}
+
+		else if (!strcmp(buf,"XPTS"))
+		{
+			TgTer_GetIntel_UShort(fp,&info->pointsX);
+			TgTer_GetIntel_UShort(fp,&pad);
+		}
+
+		else if (!strcmp(buf,"YPTS"))
+		{
+			TgTer_GetIntel_UShort(fp,&info->pointsY);
+			TgTer_GetIntel_UShort(fp,&pad);
+		}
+
+		else if (!strcmp(buf,"SCAL"))
+		{
+			info->scalOffset = offset;
+			TgTer_GetIntel_Float(fp,&info->scaleM[0]);
+			TgTer_GetIntel_Float(fp,&info->scaleM[1]);
+			TgTer_GetIntel_Float(fp,&info->scaleM[2]);
+		}
+
+		else if (!strcmp(buf,"CRAD"))
+		{
+			info->cradOffset = offset;
+			TgTer_GetIntel_Float(fp,&info->planetCurveRadiusKm);
+		}
+
+		else if (!strcmp(buf,"CRVM"))
+		{
+			info->crvmOffset = offset;
+			TgTer_GetIntel_UShort(fp,&info->planetCurveMode);
+			TgTer_GetIntel_UShort(fp,&pad);
+		}
+
+		else if (!strcmp(buf,"ALTW"))
+		{
+			info->altwOffset = offset;
+			TgTer_GetIntel_UShort(fp,(uint16_t*)&info->heightscale);
+			TgTer_GetIntel_UShort(fp,(uint16_t*)&info->baseheight);
+			info->altwDataOffset = offset + 8;
+			done = 1;
+		}
+
+		else if (!strcmp(buf,"EOF "))
+		{
+			done = 1;
+		}
+	}
+
+	return true;
+}
+
+//--------------------------------------------------------------------------------------//
+
+// ALTW samples are streamed through a fixed-size block so that memory use doesn't grow
+// with the size of the terrain, and so that we make one fread/fwrite call per block
+// rather than per sample.
+
+#define TGTER_ALTW_BLOCK_SAMPLES 16384
+
+inline int16_t TgTer_DecodeIntel_Short(const unsigned char* buf)
+{
+	return (int16_t)((((uint16_t)buf[0]) << 0)
+	               + (((uint16_t)buf[1]) << 8));
+}
+
+inline void TgTer_EncodeIntel_Short(unsigned char* buf, int16_t val)
+{
+	buf[0] = (unsigned char)(((uint16_t)val)>>0);
+	buf[1] = (unsigned char)(((uint16_t)val)>>8);
+}
+
+// Statistics of raw ALTW samples, gathered while they are decoded. Sums are exact
+// integers; a full 65535 x 65535 terrain can't overflow them. The histogram, if enabled,
+// has one count per possible sample value, indexed by sample + 32768.
+
+class TgTerAltwAccumulator
+{
+public:
+	uint64_t count;
+	int16_t minAltw;
+	int16_t maxAltw;
+	int64_t sum;
+	uint64_t sumSquares;
+	std::vector<uint64_t> histogram;
+
+	explicit TgTerAltwAccumulator(bool with_histogram)
+	  : count(0),
+		minAltw(32767),
+		maxAltw(-32768),
+		sum(0),
+		sumSquares(0)
+	{
+		if (with_histogram)
+		{
+			histogram.assign(65536, 0);
+		}
+	}
+};
+
+inline void TgTer_AccumulateAltwSamples(
+	const unsigned char* buf, uint64_t count, TgTerAltwAccumulator* accumulator)
+{
+	int16_t lo = accumulator->minAltw;
+	int16_t hi = accumulator->maxAltw;
+	int64_t sum = 0;
+	uint64_t sumsq = 0;
+	uint64_t* histogram = accumulator->histogram.empty() ? nullptr : accumulator->histogram.data();
+
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		const int16_t altw = TgTer_DecodeIntel_Short(buf + 2 * i);
+		if (altw < lo) lo = altw;
+		if (altw > hi) hi = altw;
+		sum += altw;
+		sumsq += (uint64_t)((int32_t)altw * (int32_t)altw);
+		if (histogram) ++histogram[altw + 32768];
+	}
+
+	accumulator->minAltw = lo;
+	accumulator->maxAltw = hi;
+	accumulator->sum += sum;
+	accumulator->sumSquares += sumsq;
+	accumulator->count += count;
+}
+
+inline bool TgTer_ReadAltwSamples(
+	FILE* inf, uint64_t count, int16_t heightscale, int16_t baseheight,
+	float multiplier, float* dest, unsigned int stride,
+	TgTerAltwAccumulator* optional_accumulator = nullptr)
+{
+	//reads count samples from the current position, returns false if the file is short
+
+	unsigned char buf[TGTER_ALTW_BLOCK_SAMPLES * 2];
+	const float hscale = heightscale/65536.f;
+	const uint64_t dstride = stride;
+
+	uint64_t done = 0;
+	while (done < count)
+	{
+		const uint64_t n = TGTER_MIN(count - done, (uint64_t)TGTER_ALTW_BLOCK_SAMPLES);
+		if (fread(buf, 2, (size_t)n, inf) != n)
+		{
+			return false;
+		}
+
+		float* d = dest + done * dstride;
+		for (uint64_t i = 0; i < n; ++i)
+		{
+			const int16_t altw = TgTer_DecodeIntel_Short(buf + 2 * i);
+			d[i * dstride] = (baseheight + altw * hscale) * multiplier;
+		}
+
+		if (optional_accumulator)
+		{
+			TgTer_AccumulateAltwSamples(buf, n, optional_accumulator);
+		}
+		done += n;
+	}
+	return true;
+}
+
+inline bool TgTer_ScanAltwSamples(FILE* inf, uint64_t count, int16_t* min_altw, int16_t* max_altw)
+{
+	//finds the range of the next count raw samples without decoding them
+
+	unsigned char buf[TGTER_ALTW_BLOCK_SAMPLES * 2];
+	int16_t lo = 32767;
+	int16_t hi = -32768;
+
+	uint64_t done = 0;
+	while (done < count)
+	{
+		const uint64_t n = TGTER_MIN(count - done, (uint64_t)TGTER_ALTW_BLOCK_SAMPLES);
+		if (fread(buf, 2, (size_t)n, inf) != n)
+		{
+			return false;
+		}
+
+		for (uint64_t i = 0; i < n; ++i)
+		{
+			const int16_t altw = TgTer_DecodeIntel_Short(buf + 2 * i);
+			if (altw < lo) lo = altw;
+			if (altw > hi) hi = altw;
+		}
+		done += n;
+	}
+	*min_altw = lo;
+	*max_altw = hi;
+	return true;
+}
+
+inline void TgTer_ChooseAltwScale(
+	float minalt, float maxalt, int16_t* heightscale, int16_t* baseheight)
+{
+	//choose appropriate base and scale values for alts (in file units) in this range
+
+	int16_t altscale1,altscale2;
+	int16_t basealt,altscale;
+
+	basealt = (int)( floor( (minalt + maxalt) / 2 ) + 0.5f );
+	altscale1 = ( (int)(ceil(maxalt)) - basealt ) * 2;
+	altscale2 = ( basealt - (int)(floor(minalt)) ) * 2;
+	if (altscale1 > altscale2)
+	{
+		altscale = altscale1;
+	}
+	else
+	{
+		altscale = altscale2;
+	}
+
+	*heightscale = altscale;
+	*baseheight = basealt;
+}
+
+inline bool TgTer_WriteAltwSamples(
+	FILE* outf, uint64_t count, int16_t heightscale, int16_t baseheight,
+	float multiplier, const float* src, unsigned int stride,
+	bool round_to_nearest = false)
+{
+	//compute and write map elevation values,
+	//adjusting for base and scale values that will be used when the file is read
+	//
+	//using: filevalue = (alt - basealt) / (altscale / 65536)
+	//
+	//values are truncated towards zero like Terragen's own writer, unless round_to_nearest
+	//is set, which makes alts decoded from a file with the same base and scale encode back
+	//to exactly the samples they came from
+
+	unsigned char buf[TGTER_ALTW_BLOCK_SAMPLES * 2];
+	//a heightscale of 0 (flat terrain at an integer height) can only hold baseheight
+	const float scalar = heightscale != 0 ? 65536.0f / heightscale : 0.0f;
+	const uint64_t sstride = stride;
+
+	uint64_t done = 0;
+	while (done < count)
+	{
+		const uint64_t n = TGTER_MIN(count - done, (uint64_t)TGTER_ALTW_BLOCK_SAMPLES);
+
+		const float* s = src + done * sstride;
+		for (uint64_t i = 0; i < n; ++i)
+		{
+			//clamp, because an integer maximum lands exactly on +32768 and would wrap
+			float filevalue = (s[i * sstride] * multiplier - baseheight) * scalar;
+			if (round_to_nearest)
+			{
+				filevalue = floorf(filevalue + 0.5f);
+			}
+			filevalue = TGTER_MAX(-32768.0f, TGTER_MIN(filevalue, 32767.0f));
+			TgTer_EncodeIntel_Short(buf + 2 * i, (int16_t)filevalue);
+		}
+
+		if (fwrite(buf, 2, (size_t)n, outf) != n)
+		{
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------------------------------//
+
+inline void TgTer_PartitionRows(
+	uint32_t num_rows, unsigned int num_parts, unsigned int part,
+	uint32_t* first_row, uint32_t* part_rows)
+{
+	//splits rows into num_parts contiguous bands whose sizes differ by at most one row.
+	//anything that divides work between threads by rows uses this, so that band part
+	//covers the same rows whether memory is being first touched, decoded or scanned.
+
+	const uint32_t base = num_rows / num_parts;
+	const uint32_t extra = num_rows % num_parts;
+	*first_row = part * base + (part < extra ? part : extra);
+	*part_rows = base + (part < extra ? 1 : 0);
+}
+
+//--------------------------------------------------------------------------------------//
+
+// The library's parallel functions start a new thread for each band of rows, so the
+// caller can't pin those threads itself. Instead, each thread calls bindThread with its
+// band number before touching any memory. Pinning band part to the same CPUs (or NUMA
+// node) every time keeps first-touch, decoding and scanning of a band on one node.
+//
+//     void BindToNode(unsigned int part, unsigned int num_parts, void* context)
+//     {
+//         // e.g. pthread_setaffinity_np or SetThreadGroupAffinity for part's node
+//     }
+//     TgTerThreadPlacement placement(BindToNode, nullptr);
+
+typedef void (*TgTerBindThreadFunc)(unsigned int part, unsigned int num_parts, void* context);
+
+class TgTerThreadPlacement
+{
+public:
+	TgTerBindThreadFunc bindThread;
+	void* context;
+
+	TgTerThreadPlacement(TgTerBindThreadFunc bind_thread, void* bind_context)
+	  : bindThread(bind_thread),
+		context(bind_context)
+	{
+	}
+
+	void Bind(unsigned int part, unsigned int num_parts) const
+	{
+		if (bindThread)
+		{
+			bindThread(part, num_parts, context);
+		}
+	}
+};
+
+//--------------------------------------------------------------------------------------//
+
 //////////////////////////////////////////////////////////////////////////////////////////
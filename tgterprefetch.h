@@ -0,0 +1,238 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+	\file       tgterprefetch.h
+	\brief      Contains a reader that reads and decodes a sequence of Terragen TER files
+	            ahead of use on a background thread.
+*/
+
+//--------------------------------------------------------------------------------------//
+
+/*
+MIT License
+
+Copyright (c) 2020 Matt Fairclough
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//--------------------------------------------------------------------------------------//
+
+#pragma once
+
+//--------------------------------------------------------------------------------------//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "tgterread.h"
+#include "tgteralloc.h"
+
+//--------------------------------------------------------------------------------------//
+
+class TgTerPrefetchedTerrain
+{
+public:
+	size_t index;                   // Position of this terrain in the list of filenames.
+	ResultOf_ReadTgTerFile result;  // Check result.succeeded before using the alts.
+	TgTerHeader header;
+	TgTerBuffer alts;               // Tightly packed, pointsX * pointsY values.
+
+	explicit TgTerPrefetchedTerrain(TgTerAllocator* allocator = nullptr)
+	  : index(0), header(0, 0), alts(allocator)
+	{
+	}
+};
+
+//--------------------------------------------------------------------------------------//
+
+// Reads an ordered list of TER files on a background thread so that the disk is busy with
+// the next terrains while the caller works on the current one. Terrains are handed out
+// in the order of the list by Next(), and must be handed back with Release() so their
+// buffers can be reused for terrains further down the list.
+//
+// At most lookahead_depth terrains are read ahead of the ones the caller holds. When that
+// many are waiting to be collected, or the caller holds on to buffers, the background
+// thread waits until a buffer is released. Holding more than one terrain at a time eats
+// into the lookahead, so release each terrain as soon as you are done with it. If the
+// caller holds all lookahead_depth + 1 buffers, nothing more can be read, so Next()
+// returns nullptr instead of waiting; release a terrain and call it again.
+//
+// Buffers come from allocator, or TgTer_DefaultAllocator() if it is nullptr.
+//
+//     TgTerPrefetchReader reader(filenames, 2, true, nullptr);
+//     while (TgTerPrefetchedTerrain* terrain = reader.Next())
+//     {
+//         if (terrain->result.succeeded)
+//         {
+//             // do your thing with terrain->header and terrain->alts.Data() here
+//         }
+//         reader.Release(terrain);
+//     }
+
+class TgTerPrefetchReader
+{
+public:
+	TgTerPrefetchReader(const std::vector<std::string>& file_names,
+	                    unsigned int lookahead_depth, bool alts_in_metres,
+	                    TgTerAllocator* allocator = nullptr)
+	  : filenames(file_names),
+		altsInMetres(alts_in_metres),
+		numHandedOut(0),
+		numReleased(0),
+		stopping(false)
+	{
+		//one buffer for each terrain read ahead, plus the one the caller is working on
+		const unsigned int num_buffers = (lookahead_depth > 0 ? lookahead_depth : 1) + 1;
+		for (unsigned int i = 0; i < num_buffers; ++i)
+		{
+			buffers.push_back(std::unique_ptr<TgTerPrefetchedTerrain>(new TgTerPrefetchedTerrain(allocator)));
+			freeBuffers.push_back(buffers.back().get());
+		}
+
+		worker = std::thread(&TgTerPrefetchReader::Run, this);
+	}
+
+	~TgTerPrefetchReader()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		bufferFreed.notify_all();
+		worker.join();
+	}
+
+	TgTerPrefetchedTerrain* Next()
+	{
+		//Waits for the next terrain in the list. Returns nullptr when all have been handed out,
+		//or when the caller holds every buffer so the next terrain can't be read.
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (numHandedOut == filenames.size())
+		{
+			return nullptr;
+		}
+
+		if (readyTerrains.empty() && numHandedOut - numReleased == buffers.size())
+		{
+			return nullptr;
+		}
+
+		terrainReady.wait(lock, [this] { return !readyTerrains.empty(); });
+
+		TgTerPrefetchedTerrain* terrain = readyTerrains.front();
+		readyTerrains.pop_front();
+		++numHandedOut;
+		return terrain;
+	}
+
+	void Release(TgTerPrefetchedTerrain* terrain)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			freeBuffers.push_back(terrain);
+			++numReleased;
+		}
+		bufferFreed.notify_one();
+	}
+
+private:
+	TgTerPrefetchReader(const TgTerPrefetchReader&);
+	TgTerPrefetchReader& operator=(const TgTerPrefetchReader&);
+
+	void Run()
+	{
+		for (size_t i = 0; i < filenames.size(); ++i)
+		{
+			TgTerPrefetchedTerrain* terrain = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				bufferFreed.wait(lock, [this] { return stopping || !freeBuffers.empty(); });
+				if (stopping)
+				{
+					return;
+				}
+				terrain = freeBuffers.back();
+				freeBuffers.pop_back();
+			}
+
+			Read(i, terrain);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				readyTerrains.push_back(terrain);
+			}
+			terrainReady.notify_one();
+		}
+	}
+
+	void Read(size_t index, TgTerPrefetchedTerrain* terrain)
+	{
+		//the buffer keeps its capacity, so reading terrains of the same size or smaller
+		//doesn't allocate
+
+		const char* filename = filenames[index].c_str();
+
+		terrain->index = index;
+		terrain->header = TgTerHeader(0, 0);
+		terrain->result = ReadTgTerFile(filename, 0, &terrain->header, nullptr, nullptr);
+		if (!terrain->result.succeeded)
+		{
+			return;
+		}
+
+		if (!terrain->alts.Resize((size_t)terrain->header.NumPoints(), terrain->header.pointsX))
+		{
+			terrain->result = ResultOf_ReadTgTerFile(false, filename, "Unable to allocate memory");
+			return;
+		}
+
+		const float multiplier = altsInMetres ? terrain->header.scaleM[2] : 1.0f;
+		TgTerAlts destination(terrain->alts.Data(), 1, multiplier, 1.0f / multiplier);
+		terrain->result = ReadTgTerFile(filename, 1, &terrain->header, &destination, nullptr);
+	}
+
+	const std::vector<std::string> filenames;
+	const bool altsInMetres;
+
+	std::vector<std::unique_ptr<TgTerPrefetchedTerrain> > buffers;
+
+	std::mutex mutex;
+	std::condition_variable terrainReady;
+	std::condition_variable bufferFreed;
+	std::vector<TgTerPrefetchedTerrain*> freeBuffers;
+	std::deque<TgTerPrefetchedTerrain*> readyTerrains;
+	size_t numHandedOut;
+	size_t numReleased;
+	bool stopping;
+
+	std::thread worker;
+};
+
+//--------------------------------------------------------------------------------------//
+
+//////////////////////////////////////////////////////////////////////////////////////////
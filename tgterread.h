@@ -2,7 +2,7 @@
 
 /*!
 	\file       tgterread.h
-	\brief      Contains a function for reading Terragen TER files.
+	\brief      Contains functions and a band reader for reading Terragen TER files.
 */
 
 //--------------------------------------------------------------------------------------//
@@ -39,9 +39,14 @@ SOFTWARE.
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string>
+#include <vector>
+#include <thread>
 
 #include "tgtertypes.h"
 #include "tgteriodetails.h"
+#include "tgterderivatives.h"
+#include "tgterstats.h"
 
 //--------------------------------------------------------------------------------------//
 
@@ -70,7 +75,9 @@ inline ResultOf_ReadTgTerFile
 		const int readmode,
 		TgTerHeader* header,
 		TgTerAlts* destination,
-		TgTerAltRange* optional_alt_range)
+		TgTerAltRange* optional_alt_range,
+		TgTerDerivatives* optional_derivatives = nullptr,
+		TgTerAltStats* optional_alt_stats = nullptr)
 {
 
 	/*
@@ -87,6 +94,14 @@ inline ResultOf_ReadTgTerFile
 	            calculated by looping over the alts in destination and recorded in
 	            optional_alt_range.
 
+	If readmode is 1 and optional_derivatives is supplied, surface normals and/or slope
+	and aspect are computed while the elevations are decoded, into the arrays pointed to
+	by optional_derivatives, which must also be allocated with dimensions in header.
+
+	If readmode is 1 and optional_alt_stats is supplied, statistics are gathered from the
+	raw samples as they are decoded and added to optional_alt_stats, without another pass
+	over the alts.
+
 	If readmode is 1, the alts array must already be allocated with dimensions in header.
 	This function does not set the dimensions or resize the array itself.
 	Typical usage is to call this function with a readmode of 0 to get dimensions and
@@ -102,128 +117,297 @@ inline ResultOf_ReadTgTerFile
 		return ResultOf_ReadTgTerFile(false, filename, "Unable to open terrain file");
 	}
 
-	char buf[17 * sizeof(char)];
-	buf[16] = '\0';
+	TgTerFileInfo info;
 
-	fread(buf,16,sizeof(char),fp);
-	if (strncmp(buf,"TERRAGENTERRAIN ",16))
+	if (!TgTer_ReadFileInfo(fp, &info))
 	{
 		fclose(fp);
 		return ResultOf_ReadTgTerFile(false, filename, "This is not a Terragen terrain file");
 	}
 
-	uint16_t pad;
-	uint16_t xpts = 0;
-	uint16_t ypts = 0;
-	uint16_t size;
-	float xscale = 30.f;
-	float yscale = 30.f;
-	float zscale = 30.f;
-	float radius = 6370.f;
-	uint16_t curvemode = 0;
-	int16_t heightscale = 0;
-	int16_t baseheight = 0;
+	if (readmode == 1 && info.altwDataOffset >= 0)	//reading heightfield
+	{
+		TgTerAltwAccumulator accumulator(optional_alt_stats && !optional_alt_stats->histogram.empty());
+		TgTerAltwAccumulator* rawstats = optional_alt_stats ? &accumulator : nullptr;
+
+		const bool read = optional_derivatives
+			? TgTer_ReadAltwSamplesWithDerivatives(fp, header->pointsX, header->pointsY,
+				info.scaleM, info.heightscale, info.baseheight, destination, optional_derivatives,
+				rawstats)
+			: TgTer_ReadAltwSamples(fp, header->NumPoints(), info.heightscale, info.baseheight,
+				destination->readMultiplier, destination->alts, destination->stride, rawstats);
+		if (!read)
+		{
+			fclose(fp);
+			return ResultOf_ReadTgTerFile(false, filename, "Terrain file is truncated");
+		}
 
-	bool done = false;
-	while (!done)
+		if (optional_alt_stats)
+		{
+			optional_alt_stats->AccumulateAltw(accumulator, info.heightscale, info.baseheight,
+				destination->readMultiplier);
+		}
+	}
+
+	fclose(fp);
+
+	if (readmode == 0)	//gaining info
 	{
-		fread(buf, 4, sizeof(char), fp );
-		buf[4] = '\0';
+		header->pointsX = info.pointsX;
+		header->pointsY = info.pointsY;
+		if (optional_alt_range && destination)
+		{
+			const float destmult = destination->readMultiplier;
+			optional_alt_range->minAlt = (info.baseheight - 0.5f * info.heightscale) * destmult;
+			optional_alt_range->maxAlt = (info.baseheight + 0.5f * info.heightscale) * destmult;
+		}
+	}
 
-		if (!strcmp(buf,"SIZE"))
+	header->scaleM[0] = info.scaleM[0];
+	header->scaleM[1] = info.scaleM[1];
+	header->scaleM[2] = info.scaleM[2];
+	header->planetCurveRadiusKm = info.planetCurveRadiusKm;
+	header->planetCurveMode = info.planetCurveMode;
+
+	if (readmode == 1)	//reading heighfield
+	{
+		if (optional_alt_range)
 		{
-			TgTer_GetIntel_UShort(fp,&size);
-			TgTer_GetIntel_UShort(fp,&pad);
-			if (xpts == 0) xpts = size + 1;
-			if (ypts == 0) ypts = size + 1;
+			//compute altitude range from the data (it happens in the constructor)
+			*optional_alt_range = TgTerAltRange(header, destination);
 		}
+	}
 
-		else if (!strcmp(buf,"XPTS"))
+	return ResultOf_ReadTgTerFile(true, filename, "");
+}
+
+//--------------------------------------------------------------------------------------//
+
+// Out-of-core reading of a TER file in bands of rows, for terrains too large to hold in
+// memory as one array (a 65535 x 65535 terrain is 16 GB of floats). The file stays open
+// between calls and each band is decoded straight from disk through a small fixed-size
+// buffer, so memory use is bounded by the size of the band the caller asks for.
+//
+//     TgTerBandReader reader;
+//     TgTerHeader header(0, 0);
+//     if (reader.Open(filename, &header).succeeded)
+//     {
+//         std::vector<float> band((size_t)header.pointsX * 256);
+//         TgTerAlts dest(band.data(), 1, header.scaleM[2], 1.0f / header.scaleM[2]);
+//         for (uint32_t y = 0; y < header.pointsY; y += 256)
+//         {
+//             uint32_t rows = TGTER_MIN(256u, header.pointsY - y);
+//             reader.ReadRows(y, rows, &dest);
+//             // process rows y .. y+rows-1
+//         }
+//     }
+
+class TgTerBandReader
+{
+public:
+	TgTerBandReader() : fp(nullptr)
+	{
+	}
+
+	~TgTerBandReader()
+	{
+		Close();
+	}
+
+	ResultOf_ReadTgTerFile Open(const char* file_name, TgTerHeader* header)
+	{
+		//Opens the file and reads dimensions and metadata into header (like readmode 0).
+
+		Close();
+		filename = file_name;
+
+		fp = fopen(file_name,"rb");
+		if (!fp)
 		{
-			TgTer_GetIntel_UShort(fp,&xpts);
-			TgTer_GetIntel_UShort(fp,&pad);
+			return ResultOf_ReadTgTerFile(false, filename, "Unable to open terrain file");
 		}
 
-		else if (!strcmp(buf,"YPTS"))
+		if (!TgTer_ReadFileInfo(fp, &info))
 		{
-			TgTer_GetIntel_UShort(fp,&ypts);
-			TgTer_GetIntel_UShort(fp,&pad);
+			Close();
+			return ResultOf_ReadTgTerFile(false, filename, "This is not a Terragen terrain file");
 		}
 
-		else if (!strcmp(buf,"SCAL"))
+		if (info.altwDataOffset < 0)
 		{
-			TgTer_GetIntel_Float(fp,&xscale);
-			TgTer_GetIntel_Float(fp,&yscale);
-			TgTer_GetIntel_Float(fp,&zscale);
+			Close();
+			return ResultOf_ReadTgTerFile(false, filename, "Terrain file has no altitude data");
 		}
 
-		else if (!strcmp(buf,"CRAD"))
+		header->pointsX = info.pointsX;
+		header->pointsY = info.pointsY;
+		header->scaleM[0] = info.scaleM[0];
+		header->scaleM[1] = info.scaleM[1];
+		header->scaleM[2] = info.scaleM[2];
+		header->planetCurveRadiusKm = info.planetCurveRadiusKm;
+		header->planetCurveMode = info.planetCurveMode;
+
+		return ResultOf_ReadTgTerFile(true, filename, "");
+	}
+
+	ResultOf_ReadTgTerFile ReadRows(uint32_t first_row, uint32_t num_rows, TgTerAlts* destination)
+	{
+		//Decodes rows first_row .. first_row+num_rows-1 into destination, which must have
+		//room for num_rows * pointsX alts. Rows may be read in any order.
+
+		if (!fp)
 		{
-			TgTer_GetIntel_Float(fp,&radius);
+			return ResultOf_ReadTgTerFile(false, filename, "Terrain file is not open");
 		}
 
-		else if (!strcmp(buf,"CRVM"))
+		if ((uint64_t)first_row + num_rows > info.pointsY)
 		{
-			TgTer_GetIntel_UShort(fp,&curvemode);
-			TgTer_GetIntel_UShort(fp,&pad);
+			return ResultOf_ReadTgTerFile(false, filename, "Rows are outside the terrain");
 		}
 
-		else if (!strcmp(buf,"ALTW"))
+		const uint64_t first = (uint64_t)first_row * info.pointsX;
+		if (TgTer_Seek64(fp, info.altwDataOffset + (int64_t)(first * 2)) != 0 ||
+			!TgTer_ReadAltwSamples(fp, (uint64_t)num_rows * info.pointsX, info.heightscale,
+				info.baseheight, destination->readMultiplier, destination->alts, destination->stride))
 		{
-			TgTer_GetIntel_UShort(fp,(uint16_t*)&heightscale);
-			TgTer_GetIntel_UShort(fp,(uint16_t*)&baseheight);
+			return ResultOf_ReadTgTerFile(false, filename, "Terrain file is truncated");
+		}
 
-			if (readmode == 1)	//reading heightfield
-			{
-				const float destmult = destination->readMultiplier;
-				int maxi = header->pointsX * header->pointsY;
-				for (int i = 0; i < maxi; ++i)
-				{
-					int16_t altw = 0;
-					TgTer_GetIntel_UShort(fp, (uint16_t*)&altw);
-					destination->alts[i * destination->stride] =
-						(baseheight + altw * (heightscale/65536.f)) * destmult;
-				}
-			}
+		return ResultOf_ReadTgTerFile(true, filename, "");
+	}
+
+	ResultOf_ReadTgTerFile ComputeAltRange(float read_multiplier, TgTerAltRange* alt_range)
+	{
+		//Computes the exact altitude range of the whole file in one sequential pass.
+		//Only the raw samples are scanned, nothing is decoded to floats.
 
-			done = 1;
+		if (!fp)
+		{
+			return ResultOf_ReadTgTerFile(false, filename, "Terrain file is not open");
 		}
 
-		else if (!strcmp(buf,"EOF "))
+		int16_t lo, hi;
+		if (TgTer_Seek64(fp, info.altwDataOffset) != 0 ||
+			!TgTer_ScanAltwSamples(fp, info.NumPoints(), &lo, &hi))
 		{
-			done = 1;
+			return ResultOf_ReadTgTerFile(false, filename, "Terrain file is truncated");
 		}
-	}
 
-	fclose(fp);
+		const float a = (info.baseheight + lo * (info.heightscale/65536.f)) * read_multiplier;
+		const float b = (info.baseheight + hi * (info.heightscale/65536.f)) * read_multiplier;
+		*alt_range = TgTerAltRange(TGTER_MIN(a, b), TGTER_MAX(a, b));
 
-	if (readmode == 0)	//gaining info
+		return ResultOf_ReadTgTerFile(true, filename, "");
+	}
+
+	void Close()
 	{
-		header->pointsX = xpts;
-		header->pointsY = ypts;
-		if (optional_alt_range && destination)
+		if (fp)
 		{
-			const float destmult = destination->readMultiplier;
-			optional_alt_range->minAlt = (baseheight - 0.5f * heightscale) * destmult;
-			optional_alt_range->maxAlt = (baseheight + 0.5f * heightscale) * destmult;
+			fclose(fp);
+			fp = nullptr;
 		}
 	}
 
-	header->scaleM[0] = xscale;
-	header->scaleM[1] = yscale;
-	header->scaleM[2] = zscale;
-	header->planetCurveRadiusKm = radius;
-	header->planetCurveMode = curvemode;
+	const TgTerFileInfo& Info() const
+	{
+		return info;
+	}
+
+private:
+	TgTerBandReader(const TgTerBandReader&);
+	TgTerBandReader& operator=(const TgTerBandReader&);
 
-	if (readmode == 1)	//reading heighfield
+	FILE* fp;
+	std::string filename;
+	TgTerFileInfo info;
+};
+
+//--------------------------------------------------------------------------------------//
+
+inline ResultOf_ReadTgTerFile
+	ReadTgTerFileParallel(
+		const char* filename,
+		const unsigned int num_threads,
+		TgTerHeader* header,
+		TgTerAlts* destination,
+		TgTerAltRange* optional_alt_range,
+		const TgTerThreadPlacement* optional_placement = nullptr)
+{
+	/*
+	Like ReadTgTerFile with readmode 1, but decodes with num_threads threads, each with its
+	own file handle reading its own band of rows (see TgTer_PartitionRows). The dimensions
+	in header must match the file.
+
+	If optional_placement is supplied, each thread calls it with its band number before
+	decoding. Memory from TgTerHugePageAllocator (tgteralloc.h) created with the same
+	number of threads and the same placement is first touched in the same bands on the
+	same nodes, so each thread decodes into memory local to its NUMA node.
+	*/
+
+	const unsigned int num_parts = TGTER_MAX(1u, TGTER_MIN(num_threads, header->pointsY));
+
+	std::vector<ResultOf_ReadTgTerFile> results(num_parts);
+	std::vector<TgTerHeader> headers(num_parts, *header);
+	std::vector<std::thread> threads;
+
+	for (unsigned int t = 0; t < num_parts; ++t)
 	{
-		if (optional_alt_range)
+		threads.push_back(std::thread([=, &results, &headers]
 		{
-			//compute altitude range from the data (it happens in the constructor)
-			*optional_alt_range = TgTerAltRange(header, destination);
+			if (optional_placement)
+			{
+				optional_placement->Bind(t, num_parts);
+			}
+
+			uint32_t first, count;
+			TgTer_PartitionRows(header->pointsY, num_parts, t, &first, &count);
+
+			TgTerBandReader reader;
+			results[t] = reader.Open(filename, &headers[t]);
+			if (!results[t].succeeded)
+			{
+				return;
+			}
+
+			if (headers[t].pointsX != header->pointsX || headers[t].pointsY != header->pointsY)
+			{
+				results[t] = ResultOf_ReadTgTerFile(false, filename,
+					"Terrain file dimensions don't match the header");
+				return;
+			}
+
+			TgTerAlts band(*destination);
+			band.alts += (uint64_t)first * header->pointsX * destination->stride;
+			results[t] = reader.ReadRows(first, count, &band);
+		}));
+	}
+
+	for (unsigned int t = 0; t < num_parts; ++t)
+	{
+		threads[t].join();
+	}
+
+	for (unsigned int t = 0; t < num_parts; ++t)
+	{
+		if (!results[t].succeeded)
+		{
+			return results[t];
 		}
 	}
 
+	header->scaleM[0] = headers[0].scaleM[0];
+	header->scaleM[1] = headers[0].scaleM[1];
+	header->scaleM[2] = headers[0].scaleM[2];
+	header->planetCurveRadiusKm = headers[0].planetCurveRadiusKm;
+	header->planetCurveMode = headers[0].planetCurveMode;
+
+	if (optional_alt_range)
+	{
+		//compute altitude range from the data (it happens in the constructor)
+		*optional_alt_range = TgTerAltRange(header, destination);
+	}
+
 	return ResultOf_ReadTgTerFile(true, filename, "");
 }
 
@@ -0,0 +1,333 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*!
+	\file       tgterstats.h
+	\brief      Contains a class for gathering altitude statistics (range, mean, variance,
+	            histogram and percentiles) in a single pass.
+*/
+
+//--------------------------------------------------------------------------------------//
+
+/*
+MIT License
+
+Copyright (c) 2020 Matt Fairclough
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//--------------------------------------------------------------------------------------//
+
+#pragma once
+
+//--------------------------------------------------------------------------------------//
+
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+#include <vector>
+#include <thread>
+
+#include "tgtertypes.h"
+#include "tgteriodetails.h"
+
+//--------------------------------------------------------------------------------------//
+
+// Extends TgTerAltRange with the count, mean, variance and a histogram of the alts, all
+// gathered in one pass. Partial statistics, e.g. from different threads or bands, can be
+// combined with Merge as long as they were constructed with the same histogram settings.
+//
+// The histogram has numBins equal bins from histogramMin to histogramMax. Alts outside
+// that are counted in the first or last bin. The range estimated by ReadTgTerFile with
+// readmode 0 is a good choice, because it bounds every alt the file can hold.
+
+#define TGTER_STATS_BLOCK_POINTS 4096
+
+class TgTerAltStats : public TgTerAltRange
+{
+public:
+	uint64_t count;
+	double mean;
+	double sumSquaredDeviations;    // Variance is sumSquaredDeviations / count.
+	float histogramMin;
+	float histogramMax;
+	std::vector<uint64_t> histogram;
+
+	TgTerAltStats(const float histogram_min, const float histogram_max, const unsigned int num_bins)
+	  : TgTerAltRange(FLT_MAX, -FLT_MAX),
+		count(0),
+		mean(0.0),
+		sumSquaredDeviations(0.0),
+		histogramMin(histogram_min),
+		histogramMax(histogram_max),
+		histogram(num_bins, 0)
+	{
+	}
+
+	double Variance() const
+	{
+		return count > 0 ? sumSquaredDeviations / count : 0.0;
+	}
+
+	double StandardDeviation() const
+	{
+		return sqrt(Variance());
+	}
+
+	float Percentile(const double fraction) const
+	{
+		//Estimated from the histogram, interpolating linearly within the bin.
+		//fraction is from 0 to 1, e.g. 0.5 for the median.
+		//Without a histogram all you get is minAlt or maxAlt.
+
+		if (count == 0 || histogram.empty())
+		{
+			return fraction < 0.5 ? minAlt : maxAlt;
+		}
+
+		const double target = fraction * count;
+		const double binwidth = (double)(histogramMax - histogramMin) / histogram.size();
+
+		double below = 0.0;
+		for (size_t b = 0; b < histogram.size(); ++b)
+		{
+			if (histogram[b] > 0 && below + histogram[b] >= target)
+			{
+				const double t = (target - below) / histogram[b];
+				const double alt = histogramMin + (b + t) * binwidth;
+				return (float)TGTER_MAX((double)minAlt, TGTER_MIN(alt, (double)maxAlt));
+			}
+			below += histogram[b];
+		}
+		return maxAlt;
+	}
+
+	void Accumulate(const TgTerAlts* data, const uint64_t num_points)
+	{
+		//Adds the first num_points alts in data, respecting data->stride.
+
+		const uint64_t stride = data->stride;
+		for (uint64_t first = 0; first < num_points; first += TGTER_STATS_BLOCK_POINTS)
+		{
+			const uint64_t n = TGTER_MIN(num_points - first, (uint64_t)TGTER_STATS_BLOCK_POINTS);
+			AccumulateBlock(data->alts + first * stride, n, stride);
+		}
+	}
+
+	void AccumulateAltw(const TgTerAltwAccumulator& raw,
+		const int16_t heightscale, const int16_t baseheight, const float multiplier)
+	{
+		//Adds statistics gathered from raw ALTW samples while decoding, converting them
+		//to alts the same way the decoder does. The raw accumulator's histogram is needed
+		//if this has one.
+
+		if (raw.count == 0)
+		{
+			return;
+		}
+
+		const float hscale = heightscale/65536.f;
+		const double scale = (double)hscale * multiplier;
+
+		const float a = (baseheight + raw.minAltw * hscale) * multiplier;
+		const float b = (baseheight + raw.maxAltw * hscale) * multiplier;
+		Include(TgTerAltRange(TGTER_MIN(a, b), TGTER_MAX(a, b)));
+
+		const double rawmean = (double)raw.sum / raw.count;
+		const double rawm2 = (double)raw.sumSquares - (double)raw.sum * rawmean;
+		MergeMoments(raw.count, (baseheight + rawmean * hscale) * multiplier,
+			TGTER_MAX(rawm2, 0.0) * scale * scale);
+
+		if (!histogram.empty() && !raw.histogram.empty())
+		{
+			for (int i = 0; i < 65536; ++i)
+			{
+				if (raw.histogram[i] > 0)
+				{
+					const float alt = (baseheight + (int16_t)(i - 32768) * hscale) * multiplier;
+					histogram[Bin(alt)] += raw.histogram[i];
+				}
+			}
+		}
+	}
+
+	void Merge(const TgTerAltStats& other)
+	{
+		if (other.count == 0)
+		{
+			return;
+		}
+
+		Include(other);
+		MergeMoments(other.count, other.mean, other.sumSquaredDeviations);
+		for (size_t b = 0; b < histogram.size() && b < other.histogram.size(); ++b)
+		{
+			histogram[b] += other.histogram[b];
+		}
+	}
+
+private:
+	void MergeMoments(const uint64_t n, const double other_mean, const double other_m2)
+	{
+		//Chan et al's parallel combination of mean and sum of squared deviations
+
+		const uint64_t total = count + n;
+		const double delta = other_mean - mean;
+		mean += delta * n / total;
+		sumSquaredDeviations += other_m2 + delta * delta * ((double)count * n / total);
+		count = total;
+	}
+
+	size_t Bin(const float alt) const
+	{
+		const float binscale = histogram.size() / TGTER_MAX(histogramMax - histogramMin, 1e-6f);
+		const float bin = (alt - histogramMin) * binscale;
+		if (!(bin > 0.0f))
+		{
+			return 0;
+		}
+		return TGTER_MIN((size_t)bin, histogram.size() - 1);
+	}
+
+	void AccumulateBlock(const float* alts, const uint64_t n, const uint64_t stride)
+	{
+		//min and max of a block in float, and its sums in double relative to its first
+		//alt, then folded into the running totals. the sums must be double: if the first
+		//alt is far from the rest (a row starting on a cliff), sumsq - sum*mean cancels
+		//away most of the digits a float sum would have
+
+		const float shift = alts[0];
+		const double dshift = shift;
+		float lo = alts[0];
+		float hi = alts[0];
+		double sum = 0.0;
+		double sumsq = 0.0;
+		uint64_t i = 0;
+
+#ifdef TGTER_SSE2
+		if (stride == 1 && n >= 4)
+		{
+			const __m128d vshift = _mm_set1_pd(dshift);
+			__m128 vlo = _mm_set1_ps(shift);
+			__m128 vhi = vlo;
+			__m128d vsum = _mm_setzero_pd();
+			__m128d vsumsq = _mm_setzero_pd();
+			for (; i + 4 <= n; i += 4)
+			{
+				const __m128 v = _mm_loadu_ps(alts + i);
+				vlo = _mm_min_ps(vlo, v);
+				vhi = _mm_max_ps(vhi, v);
+
+				const __m128d d0 = _mm_sub_pd(_mm_cvtps_pd(v), vshift);
+				const __m128d d1 = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), vshift);
+				vsum = _mm_add_pd(vsum, _mm_add_pd(d0, d1));
+				vsumsq = _mm_add_pd(vsumsq, _mm_add_pd(_mm_mul_pd(d0, d0), _mm_mul_pd(d1, d1)));
+			}
+
+			float l[4], h[4];
+			double s[2], q[2];
+			_mm_storeu_ps(l, vlo);
+			_mm_storeu_ps(h, vhi);
+			_mm_storeu_pd(s, vsum);
+			_mm_storeu_pd(q, vsumsq);
+			for (int k = 0; k < 4; ++k)
+			{
+				if (l[k] < lo) lo = l[k];
+				if (h[k] > hi) hi = h[k];
+			}
+			sum = s[0] + s[1];
+			sumsq = q[0] + q[1];
+		}
+#endif
+
+		for (; i < n; ++i)
+		{
+			const float v = alts[i * stride];
+			const double d = v - dshift;
+			if (v < lo) lo = v;
+			if (v > hi) hi = v;
+			sum += d;
+			sumsq += d * d;
+		}
+
+		Include(TgTerAltRange(lo, hi));
+
+		const double blockmean = sum / n;
+		const double blockm2 = sumsq - sum * blockmean;
+		MergeMoments(n, dshift + blockmean, TGTER_MAX(blockm2, 0.0));
+
+		//the histogram goes over the same block while it is still in cache
+		if (!histogram.empty())
+		{
+			for (i = 0; i < n; ++i)
+			{
+				++histogram[Bin(alts[i * stride])];
+			}
+		}
+	}
+};
+
+//--------------------------------------------------------------------------------------//
+
+inline void ComputeTgTerAltStatsParallel(
+	const TgTerHeader* header,
+	const TgTerAlts* data,
+	const unsigned int num_threads,
+	TgTerAltStats* stats,
+	const TgTerThreadPlacement* optional_placement = nullptr)
+{
+	//Adds all of the alts in data to stats, with each of num_threads threads working on
+	//its own band of rows (see TgTer_PartitionRows) and the results merged in order.
+	//If optional_placement is supplied, each thread calls it with its band number first.
+
+	const unsigned int num_parts = TGTER_MAX(1u, TGTER_MIN(num_threads, header->pointsY));
+
+	const TgTerAltStats empty(stats->histogramMin, stats->histogramMax,
+		(unsigned int)stats->histogram.size());
+	std::vector<TgTerAltStats> partials(num_parts, empty);
+	std::vector<std::thread> threads;
+
+	for (unsigned int t = 0; t < num_parts; ++t)
+	{
+		threads.push_back(std::thread([=, &partials]
+		{
+			if (optional_placement)
+			{
+				optional_placement->Bind(t, num_parts);
+			}
+
+			uint32_t first, rows;
+			TgTer_PartitionRows(header->pointsY, num_parts, t, &first, &rows);
+
+			TgTerAlts band(*data);
+			band.alts += (uint64_t)first * header->pointsX * data->stride;
+			partials[t].Accumulate(&band, (uint64_t)rows * header->pointsX);
+		}));
+	}
+
+	for (unsigned int t = 0; t < num_parts; ++t)
+	{
+		threads[t].join();
+		stats->Merge(partials[t]);
+	}
+}
+
+//--------------------------------------------------------------------------------------//
+
+//////////////////////////////////////////////////////////////////////////////////////////
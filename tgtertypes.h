@@ -63,6 +63,12 @@ public:
 		scaleM[1] = 30.0f;
 		scaleM[2] = 30.0f;
 	}
+
+	uint64_t NumPoints() const
+	{
+		// 64-bit so that maximum-size (65535 x 65535) grids don't overflow.
+		return (uint64_t)pointsX * (uint64_t)pointsY;
+	}
 };
 
 //--------------------------------------------------------------------------------------//
@@ -107,11 +113,25 @@ public:
 
 	TgTerAltRange(const TgTerHeader* header, const TgTerAlts* data)
 	{
+		Compute(data, header->NumPoints());
+	}
+
+	void Include(const TgTerAltRange& other)
+	{
+		// Merges another range into this one, e.g. when accumulating over bands.
+		if (other.minAlt < minAlt) minAlt = other.minAlt;
+		if (other.maxAlt > maxAlt) maxAlt = other.maxAlt;
+	}
+
+	void Compute(const TgTerAlts* data, const uint64_t num_points)
+	{
+		// Range of the first num_points alts in data, e.g. one band of rows.
 		const float* alts = data->alts;
+		const uint64_t stride = data->stride;
 
 		minAlt = maxAlt = alts[0];
-		int maxi = header->pointsX * header->pointsY * data->stride;
-		for (int i = 0; i < maxi; i += data->stride)
+		const uint64_t maxi = num_points * stride;
+		for (uint64_t i = 0; i < maxi; i += stride)
 		{
 			if (alts[i] < minAlt) minAlt = alts[i];
 			if (alts[i] > maxAlt) maxAlt = alts[i];
@@ -121,4 +141,34 @@ public:
 
 //--------------------------------------------------------------------------------------//
 
+class TgTerDerivatives
+{
+public:
+	int16_t* normals;               // Optional pointer to an array of 2 * pointsX * pointsY
+	                                // int16 values to receive packed unit surface normals,
+	                                // or nullptr. Both components are snorm16 (value/32767).
+	int normalEncoding;             // 0: octahedral encoding of the normal.
+	                                // 1: X and Y of the normal, Z is sqrt(1 - X*X - Y*Y).
+	float* slopes;                  // Optional pointer to an array of pointsX * pointsY
+	                                // slope angles in radians (0 is flat), or nullptr.
+	float* aspects;                 // Optional pointer to an array of pointsX * pointsY
+	                                // aspects in radians, or nullptr. This is the direction
+	                                // of steepest descent, anticlockwise from the +X axis
+	                                // of the grid, in the range -pi to pi.
+
+	// Derivatives are central differences in metres using header->scaleM, with
+	// one-sided differences along the edges of the terrain. Normals point towards +Z.
+
+	TgTerDerivatives(int16_t* packed_normals, int normal_encoding,
+	                 float* slope_angles, float* aspect_angles)
+	  : normals(packed_normals),
+		normalEncoding(normal_encoding),
+		slopes(slope_angles),
+		aspects(aspect_angles)
+	{
+	}
+};
+
+//--------------------------------------------------------------------------------------//
+
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -2,7 +2,8 @@
 
 /*!
 	\file       tgterwrite.h
-	\brief      Contains functions for writing Terragen TER files and raw heightmap files.
+	\brief      Contains functions for writing Terragen TER files and raw heightmap files,
+	            and a band writer for writing TER files out-of-core.
 */
 
 //--------------------------------------------------------------------------------------//
@@ -39,6 +40,7 @@ SOFTWARE.
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string>
 
 #include "tgtertypes.h"
 #include "tgteriodetails.h"
@@ -64,22 +66,10 @@ public:
 
 typedef ResultOf_WriteTgTerFile ResultOf_WriteRawFile;
 
-#define TGTER_MAX(a, b) (a > b ? a : b)
-#define TGTER_MIN(a, b) (a < b ? a : b)
-
 //--------------------------------------------------------------------------------------//
 
-inline ResultOf_WriteTgTerFile
-	WriteTgTerFile(const char* filename, const TgTerHeader* header, const TgTerAlts* source)
+inline void TgTer_WriteHeaderChunks(FILE* of, const TgTerHeader* header)
 {
-
-	FILE* of = fopen(filename,"wb");
-
-	if (!of)
-	{
-		return ResultOf_WriteTgTerFile(false, filename, "Unable to open output file");
-	}
-
 	fwrite("TERRAGENTERRAIN ", 16, 1, of);
 
 	fwrite("SIZE", 4, 1, of);
@@ -105,6 +95,22 @@ inline ResultOf_WriteTgTerFile
 	fwrite("CRVM", 4, 1, of);
 	TgTer_PutIntel_UShort(of, header->planetCurveMode);
 	TgTer_PutIntel_UShort(of, 0);
+}
+
+//--------------------------------------------------------------------------------------//
+
+inline ResultOf_WriteTgTerFile
+	WriteTgTerFile(const char* filename, const TgTerHeader* header, const TgTerAlts* source)
+{
+
+	FILE* of = fopen(filename,"wb");
+
+	if (!of)
+	{
+		return ResultOf_WriteTgTerFile(false, filename, "Unable to open output file");
+	}
+
+	TgTer_WriteHeaderChunks(of, header);
 
 
 	fwrite("ALTW", 4, 1, of);
@@ -115,50 +121,161 @@ inline ResultOf_WriteTgTerFile
 	const float minalt = altRange.minAlt * source->writeMultiplier;
 	const float maxalt = altRange.maxAlt * source->writeMultiplier;
 
-	int16_t altscale1,altscale2;
 	int16_t basealt,altscale;
+	TgTer_ChooseAltwScale(minalt, maxalt, &altscale, &basealt);
+
+	//write base and scale values
+	TgTer_PutIntel_UShort(of, altscale);
+	TgTer_PutIntel_UShort(of, basealt);
+
+	//now compute and write map elevation values
+	bool written = TgTer_WriteAltwSamples(of, header->NumPoints(), altscale, basealt,
+		source->writeMultiplier, source->alts, source->stride);
 
-	//choose appropriate base and scale values
-	basealt = (int)( floor( (minalt + maxalt) / 2 ) + 0.5f );
-	altscale1 = ( (int)(ceil(maxalt)) - basealt ) * 2;
-	altscale2 = ( basealt - (int)(floor(minalt)) ) * 2;
-	if (altscale1 > altscale2)
+	if (header->NumPoints() % 2 > 0)
 	{
-		altscale = altscale1;
+		TgTer_PutIntel_UShort(of, 0);
 	}
-	else
+
+	fwrite("EOF ", 4, 1, of);
+
+	if (fclose(of) != 0 || !written)
 	{
-		altscale = altscale2;
+		return ResultOf_WriteTgTerFile(false, filename, "Unable to write output file");
 	}
 
-	//write base and scale values
-	TgTer_PutIntel_UShort(of, altscale);
-	TgTer_PutIntel_UShort(of, basealt);
+	return ResultOf_WriteTgTerFile(true, filename, "");
+}
 
-	//now compute and write map elevation values,
-	//adjusting for base and scale values that will be used when the file is read
-	//
-	//using: filevalue = (alt - basealt) / (altscale / 65536)
+//--------------------------------------------------------------------------------------//
 
-	const float scalar = 65536.0f / altscale;
+// Out-of-core writing of a TER file in bands of rows. The ALTW base and scale values come
+// before the samples in the file, so the altitude range of the whole terrain must be
+// known before the first row is written. For data that doesn't fit in memory, build it up
+// band by band with TgTerAltRange::Include (or TgTerBandReader::ComputeAltRange when the
+// source is another TER file), then write the same bands in order with WriteRows.
 
-	int maxi = header->pointsX * header->pointsY * source->stride;
-	for (int i = 0; i < maxi; i += source->stride)
+class TgTerBandWriter
+{
+public:
+	TgTerBandWriter() : of(nullptr), pointsX(0), pointsY(0), rowsWritten(0),
+		writeMultiplier(1.0f), heightscale(0), baseheight(0)
 	{
-		TgTer_PutIntel_UShort(of, (int16_t)((source->alts[i] * source->writeMultiplier - basealt) * scalar));
 	}
 
-	if ((header->pointsX * header->pointsY) % 2 > 0)
+	~TgTerBandWriter()
 	{
-		TgTer_PutIntel_UShort(of, 0);
+		if (of)
+		{
+			fclose(of);
+		}
 	}
 
-	fwrite("EOF ", 4, 1, of);
+	ResultOf_WriteTgTerFile Open(const char* file_name, const TgTerHeader* header,
+		const TgTerAltRange* alt_range, float write_multiplier)
+	{
+		//alt_range is in source units, i.e. before write_multiplier is applied,
+		//and write_multiplier must match that of the TgTerAlts passed to WriteRows.
 
-	fclose(of);
+		if (of)
+		{
+			fclose(of);
+		}
+		filename = file_name;
+		pointsX = header->pointsX;
+		pointsY = header->pointsY;
+		rowsWritten = 0;
+		writeMultiplier = write_multiplier;
 
-	return ResultOf_WriteTgTerFile(true, filename, "");
-}
+		of = fopen(file_name,"wb");
+		if (!of)
+		{
+			return ResultOf_WriteTgTerFile(false, filename, "Unable to open output file");
+		}
+
+		TgTer_WriteHeaderChunks(of, header);
+
+		fwrite("ALTW", 4, 1, of);
+
+		const float a = alt_range->minAlt * write_multiplier;
+		const float b = alt_range->maxAlt * write_multiplier;
+		TgTer_ChooseAltwScale(TGTER_MIN(a, b), TGTER_MAX(a, b), &heightscale, &baseheight);
+
+		TgTer_PutIntel_UShort(of, heightscale);
+		TgTer_PutIntel_UShort(of, baseheight);
+
+		return ResultOf_WriteTgTerFile(true, filename, "");
+	}
+
+	ResultOf_WriteTgTerFile WriteRows(uint32_t num_rows, const TgTerAlts* source)
+	{
+		//Writes the next num_rows rows, taken from num_rows * pointsX alts in source.
+
+		if (!of)
+		{
+			return ResultOf_WriteTgTerFile(false, filename, "Output file is not open");
+		}
+
+		if ((uint64_t)rowsWritten + num_rows > pointsY)
+		{
+			return ResultOf_WriteTgTerFile(false, filename, "Too many rows written");
+		}
+
+		if (!TgTer_WriteAltwSamples(of, (uint64_t)num_rows * pointsX, heightscale, baseheight,
+			writeMultiplier, source->alts, source->stride))
+		{
+			return ResultOf_WriteTgTerFile(false, filename, "Unable to write output file");
+		}
+
+		rowsWritten += num_rows;
+		return ResultOf_WriteTgTerFile(true, filename, "");
+	}
+
+	ResultOf_WriteTgTerFile Close()
+	{
+		//Finishes the file. All pointsY rows must have been written.
+
+		if (!of)
+		{
+			return ResultOf_WriteTgTerFile(false, filename, "Output file is not open");
+		}
+
+		const bool complete = (rowsWritten == pointsY);
+
+		if ((uint64_t)pointsX * pointsY % 2 > 0)
+		{
+			TgTer_PutIntel_UShort(of, 0);
+		}
+
+		fwrite("EOF ", 4, 1, of);
+
+		const bool closed = (fclose(of) == 0);
+		of = nullptr;
+
+		if (!complete)
+		{
+			return ResultOf_WriteTgTerFile(false, filename, "Not all rows were written");
+		}
+		if (!closed)
+		{
+			return ResultOf_WriteTgTerFile(false, filename, "Unable to write output file");
+		}
+		return ResultOf_WriteTgTerFile(true, filename, "");
+	}
+
+private:
+	TgTerBandWriter(const TgTerBandWriter&);
+	TgTerBandWriter& operator=(const TgTerBandWriter&);
+
+	FILE* of;
+	std::string filename;
+	uint32_t pointsX;
+	uint32_t pointsY;
+	uint32_t rowsWritten;
+	float writeMultiplier;
+	int16_t heightscale;
+	int16_t baseheight;
+};
 
 //--------------------------------------------------------------------------------------//
 
@@ -183,8 +300,9 @@ inline ResultOf_WriteRawFile
 	const float maxalt = altRange.maxAlt * source->writeMultiplier;
 	const float scalar = 65535.9f / TGTER_MAX((maxalt-minalt), 1e-6f);
 
-	int maxi = header->pointsX * header->pointsY * source->stride;
-	for (int i = 0; i < maxi; i += source->stride)
+	const uint64_t stride = source->stride;
+	const uint64_t maxi = header->NumPoints() * stride;
+	for (uint64_t i = 0; i < maxi; i += stride)
 	{
 		float elev_f = (source->alts[i] * source->writeMultiplier - minalt) * scalar;
 		TgTer_PutIntel_UShort(of, (uint16_t)floorf(elev_f));